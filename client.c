@@ -8,6 +8,9 @@ int main(int argc, char *argv[]) {
         {"port", required_argument, NULL, 'p'},
         {"log", required_argument, NULL, 'l'},
         {"compress", no_argument, NULL, 'c'},
+        {"predict", no_argument, NULL, 'e'},
+        {"resume", required_argument, NULL, 'r'},
+        {"record", required_argument, NULL, 't'},
         {0, 0, 0, 0}};
 
     int opt;
@@ -15,8 +18,10 @@ int main(int argc, char *argv[]) {
     int logOpt = 0;
     int log_fd = 0;
     int compressOpt = 0;
+    int predictOpt = 0;
+    int flags;
 
-    while ((opt = getopt_long(argc, argv, "p:lc", options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:lcer:t:", options, NULL)) != -1) {
         switch (opt) {
         case 'p':
             portno = atoi(optarg);
@@ -33,20 +38,34 @@ int main(int argc, char *argv[]) {
         case 'c':
             compressOpt = 1;
             break;
+        case 'e':
+            predictOpt = 1;
+            break;
+        case 'r':
+            session.enabled = 1;
+            session.retry = atoi(optarg);
+            break;
+        case 't':
+            if (trace_open(optarg) < 0) {
+                fprintf(stderr, "Unable to create trace file. Error: %d, Message: %s\n", errno, strerror(errno));
+                exit(1);
+            }
+            break;
         default:
-            fprintf(stderr, "Incorrect argument: correct usage is ./client --port=portno [--log=pathname] [--compress]\n");
+            fprintf(stderr, "Incorrect argument: correct usage is ./client --port=portno [--log=pathname] [--compress] [--predict] [--resume=seconds] [--record=pathname]\n");
             exit(1);
         }
     }
 
     if (!portOpt) {
-        fprintf(stderr, "Incorrect argument: correct usage is ./client --port=portno [--log=pathname] [--compress]\n");
+        fprintf(stderr, "Incorrect argument: correct usage is ./client --port=portno [--log=pathname] [--compress] [--predict] [--resume=seconds] [--record=pathname]\n");
         fprintf(stderr, "port not specified\n");
         exit(1);
     }
 
     setvbuf(stdout, NULL, _IONBF, 0);
-    set_input_mode();
+    if (session.enabled) // a dead connection is reported by send() instead
+        signal(SIGPIPE, SIG_IGN);
 
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (socket_fd < 0)
@@ -66,6 +85,26 @@ int main(int argc, char *argv[]) {
     if (connect(socket_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
         error("Error in establishing connection.\n");
 
+    flags = read_greeting(socket_fd);
+    if (flags < 0) {
+        fprintf(stderr, "Server did not greet\n");
+        exit(1);
+    }
+    if (predictOpt && !(flags & GREETING_PTY)) {
+        // bash on pipes never echoes, so no prediction would be confirmed
+        fprintf(stderr, "Server runs without --pty, --predict is disabled\n");
+        predictOpt = 0;
+    }
+    // a server started with --pty echoes and edits lines itself
+    set_input_mode(flags & GREETING_PTY);
+    predict.enabled = predictOpt;
+    predict.shown = 1;
+
+    if (session.enabled && attach_session(socket_fd) < 0) {
+        fprintf(stderr, "Server refused the session\n");
+        exit(1);
+    }
+
     struct pollfd fds[2];
     fds[0].fd = STDIN_FILENO;
     fds[0].events = POLLIN | POLLHUP | POLLERR;
@@ -76,11 +115,21 @@ int main(int argc, char *argv[]) {
     for (;;) {
 
         poll(fds, 2, 0);
+        if (predict.enabled)
+            predict_expire();
 
         if (fds[0].revents & POLLIN) {
             int ret;
             ret = pipe_to_bash(STDIN_FILENO, socket_fd, compressOpt, logOpt, log_fd);
-            if (ret != Z_OK)
+            if (ret == SESSION_DETACHED) {
+                if (reconnect() < 0) {
+                    fprintf(stderr, "Unable to resume the session\r\n");
+                    exit(1);
+                }
+                fds[1].fd = socket_fd;
+                continue;
+            }
+            else if (ret != Z_OK)
                 exit(ret);
         }
 
@@ -92,11 +141,23 @@ int main(int argc, char *argv[]) {
         if (fds[1].revents & POLLIN) {
             int ret;
             ret = pipe_to_server(socket_fd, STDOUT_FILENO, compressOpt, logOpt, log_fd);
-            if (ret != Z_OK)
+            if (ret == SESSION_DETACHED) {
+                if (reconnect() < 0) {
+                    fprintf(stderr, "Unable to resume the session\r\n");
+                    exit(1);
+                }
+                fds[1].fd = socket_fd;
+                continue;
+            }
+            else if (ret != Z_OK)
                 exit(ret);
         }
 
         if (fds[1].revents & (POLLHUP | POLLERR)) {
+            if (session.enabled && reconnect() == 0) {
+                fds[1].fd = socket_fd;
+                continue;
+            }
             fprintf(stderr, "Server shut down!!\n");
             exit(1);
         }
@@ -17,9 +17,15 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <endian.h>
 #include <zlib.h>
+#include "codec.h"
+#include "protocol.h"
+#include "trace.h"
 
-#define CHUNK 256
+#define PREDICT_MAX 256
+#define PREDICT_TIMEOUT 250 // milliseconds, plus twice the usual echo time
 
 struct termios original_attributes;
 struct termios new_attributes;
@@ -28,6 +34,38 @@ int socket_fd;
 struct sockaddr_in serv_addr;
 struct hostent *server;
 
+/* predictive local echo (--predict): printable keystrokes are drawn
+   underlined at once and reconciled against the server's echo, they are
+   hidden while the server does not echo (password prompts) */
+struct prediction {
+    int enabled;
+    int shown;      // pending predictions are drawn on screen
+    int blocked;    // an unpredicted key was typed, wait for the server
+    int fullscreen; // remote program is on the alternate screen
+    int count;
+    long long since; // when the oldest pending prediction was typed, ms
+    long long echo;  // smoothed time the server takes to echo, ms
+    unsigned char pending[PREDICT_MAX];
+} predict;
+
+/* detachable session (--resume): after a network drop the client
+   reconnects and the server replays the output it missed */
+struct session {
+    int enabled;
+    int retry; // seconds to keep trying to reconnect
+    uint64_t token;
+    uint64_t received; // bytes of shell output written to stdout
+    int ended;         // SESSION_END was the last thing received
+    int end_match;     // bytes of SESSION_END matched so far
+} session;
+
+/* where pipe_to_bash() sends its frames */
+struct sender {
+    int fd;
+    int logOpt;
+    int log_fd;
+};
+
 void error(const char *string) {
     perror(string);
     exit(1);
@@ -41,7 +79,7 @@ void sig_handler(int sig) {
 
     if (sig == SIGINT) {
         // fprintf(stderr, "SIGINT received!!\n");
-        int sigint = htonl(0x03);
+        char sigint = 0x03;
         send(socket_fd, &sigint, sizeof(sigint), 0);
     }
 }
@@ -61,7 +99,7 @@ void reset() {
     }
 }
 
-void set_input_mode() {
+void set_input_mode(int characterOpt) {
     save_terminal_attributes();
     atexit(reset);
 
@@ -72,6 +110,13 @@ void set_input_mode() {
     // new_attributes.c_lflag &= ~(ISIG);
     new_attributes.c_cc[VINTR] = 3; // ^C
     new_attributes.c_cc[VEOF] = 4;  // ^D
+    if (characterOpt) {
+        // send every keystroke as typed, echo comes from the remote terminal
+        // or is drawn by predict_input(); ^C and ^D go out as plain bytes
+        new_attributes.c_lflag &= ~(ICANON | ECHO | ISIG);
+        new_attributes.c_cc[VMIN] = 1;
+        new_attributes.c_cc[VTIME] = 0;
+    }
     int res = tcsetattr(STDIN_FILENO, TCSANOW, &new_attributes);
     if (res < 0) {
         fprintf(stderr, "Error with setting attributes. Error: %d, Message: %s\n", errno, strerror(errno));
@@ -79,48 +124,229 @@ void set_input_mode() {
     }
 }
 
-int init_compress(z_streamp defstream)
-{
-    int ret;
+void predict_draw(const unsigned char *buf, int n) {
+    if (n <= 0)
+        return;
+    write(STDOUT_FILENO, "\033[4m", 4);
+    write(STDOUT_FILENO, buf, n);
+    write(STDOUT_FILENO, "\033[24m", 5);
+}
 
-    /* allocate deflate state */
-    defstream->zalloc = Z_NULL;
-    defstream->zfree = Z_NULL;
-    defstream->opaque = Z_NULL;
-    ret = deflateInit(defstream, Z_DEFAULT_COMPRESSION);
-    if (ret != Z_OK)
-        return ret;
+long long predict_clock() {
+    return trace_clock() / 1000;
+}
 
-    return Z_OK;
+void predict_input(const unsigned char *buf, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned char c = buf[i];
+        if (c >= 0x20 && c < 0x7f) {
+            if (predict.blocked || predict.fullscreen || predict.count == PREDICT_MAX)
+                continue;
+            if (predict.count == 0)
+                predict.since = predict_clock();
+            predict.pending[predict.count++] = c;
+            if (predict.shown)
+                predict_draw(&c, 1);
+        }
+        else {
+            // editing and control keys are left to the server; predictions
+            // typed after them stay hidden until an echo is confirmed again
+            predict.blocked = 1;
+        }
+    }
+}
+
+void predict_screen_mode(const unsigned char *buf, int n) {
+    static const char *enter[] = {"\033[?1049h", "\033[?1047h", "\033[?47h"};
+    static const char *leave[] = {"\033[?1049l", "\033[?1047l", "\033[?47l"};
+
+    for (int i = 0; i < n; i++) {
+        if (buf[i] != 0x1b)
+            continue;
+        for (int j = 0; j < 3; j++) {
+            size_t len = strlen(enter[j]);
+            if (n - i >= (int)len && memcmp(buf + i, enter[j], len) == 0)
+                predict.fullscreen = 1;
+            if (n - i >= (int)len && memcmp(buf + i, leave[j], len) == 0)
+                predict.fullscreen = 0;
+        }
+    }
+}
+
+int predict_write(int __fd, const unsigned char *buf, int n) {
+    char move[16];
+    int matched = 0;
+
+    if (!predict.enabled)
+        return write(__fd, buf, n);
+
+    while (matched < n && matched < predict.count && buf[matched] == predict.pending[matched])
+        matched++;
+
+    if (predict.shown && predict.count > 0)
+        write(__fd, move, snprintf(move, sizeof(move), "\033[%dD", predict.count));
+
+    if (matched == n || matched == predict.count) {
+        // the server echoed what we predicted, its output replaces ours
+        if (write(__fd, buf, n) != n)
+            return -1;
+        memmove(predict.pending, predict.pending + matched, predict.count - matched);
+        predict.count -= matched;
+        if (matched > 0) {
+            long long now = predict_clock();
+            predict.echo = (3 * predict.echo + (now - predict.since)) / 4;
+            predict.since = now;
+            predict.shown = 1;
+        }
+        if (predict.shown)
+            predict_draw(predict.pending, predict.count);
+    }
+    else {
+        // something else came back: wipe the guesses, the server output
+        // decides where the cursor is now
+        if (predict.shown)
+            write(__fd, "\033[K", 3);
+        if (write(__fd, buf, n) != n)
+            return -1;
+        predict.count = 0;
+    }
+
+    predict_screen_mode(buf, n);
+    if (predict.fullscreen) {
+        predict.count = 0;
+        predict.shown = 0;
+    }
+    if (predict.count == 0 && predict.blocked)
+        predict.blocked = 0;
+    return n;
 }
 
-int init_uncompress(z_streamp infstream)
-{
-    int ret;
+/* a prediction the server has not echoed in time means echo is off, so
+   stop drawing until an echo is confirmed again */
+void predict_expire() {
+    char move[16];
+
+    if (!predict.shown || predict.count == 0 || predict_clock() - predict.since < PREDICT_TIMEOUT + 2 * predict.echo)
+        return;
+
+    write(STDOUT_FILENO, move, snprintf(move, sizeof(move), "\033[%dD", predict.count));
+    write(STDOUT_FILENO, "\033[K", 3);
+    predict.shown = 0;
+}
 
-    /* allocate inflate state */
-    infstream->zalloc = Z_NULL;
-    infstream->zfree = Z_NULL;
-    infstream->opaque = Z_NULL;
-    infstream->avail_in = 0;
-    infstream->next_in = Z_NULL;
-    ret = inflateInit(infstream);
-    if (ret != Z_OK)
-        return ret;
+void predict_reset() {
+    char move[16];
 
+    if (predict.shown && predict.count > 0) {
+        write(STDOUT_FILENO, move, snprintf(move, sizeof(move), "\033[%dD", predict.count));
+        write(STDOUT_FILENO, "\033[K", 3);
+    }
+    predict.count = 0;
+    predict.shown = 1;
+    predict.blocked = 0;
+}
+
+int attach_session(int __fd) {
+    uint64_t hello[2], reply[2];
+    uint64_t start;
+
+    set_keepalive(__fd);
+
+    hello[0] = htobe64(session.token);
+    hello[1] = htobe64(session.received);
+    if (send(__fd, hello, sizeof(hello), 0) != sizeof(hello))
+        return -1;
+    set_recv_timeout(__fd, HANDSHAKE_TIMEOUT);
+    if (recv(__fd, reply, sizeof(reply), MSG_WAITALL) != sizeof(reply) || reply[0] == 0)
+        return -1;
+    set_recv_timeout(__fd, 0);
+
+    session.token = be64toh(reply[0]);
+    start = be64toh(reply[1]);
+    if (start > session.received)
+        fprintf(stderr, "\r\n[%llu bytes of output were lost]\r\n", (unsigned long long)(start - session.received));
+    session.received = start;
+    session.end_match = 0;
+    return 0;
+}
+
+/* the marker only counts as the very last output, a shell that merely
+   printed it keeps the session */
+void session_scan(const unsigned char *buf, int n) {
+    static const char marker[] = SESSION_END;
+
+    for (int i = 0; i < n; i++) {
+        session.ended = 0;
+        if (buf[i] == marker[session.end_match])
+            session.end_match++;
+        else
+            session.end_match = buf[i] == marker[0];
+        if (session.end_match == sizeof(marker) - 1) {
+            session.ended = 1;
+            session.end_match = 0;
+        }
+    }
+}
+
+int reconnect() {
+    if (session.ended) // the shell exited, the connection was closed on purpose
+        exit(0);
+
+    predict_reset();
+    fprintf(stderr, "\r\nConnection lost, reconnecting...\r\n");
+    close(socket_fd);
+
+    for (int i = 0; i < session.retry; i++) {
+        sleep(1);
+        socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (socket_fd < 0)
+            error("ERROR opening socket");
+        if (connect(socket_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) == 0)
+            return read_greeting(socket_fd) < 0 ? -1 : attach_session(socket_fd);
+
+        if (errno == ECONNREFUSED) { // nobody listening, the session is gone
+            fprintf(stderr, "Session ended\r\n");
+            exit(0);
+        }
+        close(socket_fd);
+    }
+    return -1;
+}
+
+int send_frame(void *ctx, unsigned char *buf, unsigned n) {
+    struct sender *to = ctx;
+
+    if (send(to->fd, buf, n, 0) != n)
+        return Z_ERRNO;
+
+    if (to->logOpt == 1) {
+        dprintf(to->log_fd, "SENT %d bytes: ", n);
+        write(to->log_fd, buf, n);
+        // dprintf(log_fd, &carriage[1], sizeof(char));
+    }
+    return Z_OK;
+}
+
+int show_output(void *ctx, unsigned char *buf, unsigned n) {
+    if (predict_write(*(int *)ctx, buf, n) != (int)n)
+        return Z_ERRNO;
+
+    trace_write(TRACE_OUTPUT, buf, n);
+    session.received += n;
+    if (session.enabled)
+        session_scan(buf, n);
     return Z_OK;
 }
 
 int pipe_to_bash(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_fd) {
 
     int ret, size, flush;
-    unsigned have;
-    z_stream defstream;
+    z_stream defstream = {0};
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+    struct sender to = {__fd2, logOpt, __log_fd};
 
     if (compressOpt) {
-        ret = init_compress(&defstream);
+        ret = init_compress(&defstream, Z_DEFAULT_COMPRESSION);
         if (ret != Z_OK)
             return ret;
     }
@@ -136,47 +362,22 @@ int pipe_to_bash(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_fd
         }
         if (size == 0) {
             fprintf(stdout, "^D\r\n");
-            int sigpipe = htonl(0x04);
+            char sigpipe = 0x04;
             send(__fd2, &sigpipe, sizeof(sigpipe), 0);
         }
+        if (predict.enabled)
+            predict_input(in, size);
+        trace_write(TRACE_INPUT, in, size);
         flush = size != CHUNK ? Z_FINISH : Z_NO_FLUSH;
 
-        if (!compressOpt) {
-            have = size;
-            if (send(__fd2, in, have, 0) != have) {
-                deflateEnd(&defstream);
-                return Z_ERRNO;
-            }
+        if (!compressOpt)
+            ret = size > 0 ? send_frame(&to, in, size) : Z_OK;
+        else
+            ret = deflate_frames(&defstream, in, size, flush, CHUNK, send_frame, &to);
 
-            if (logOpt == 1) {
-                dprintf(__log_fd, "SENT %d bytes: ", have);
-                write(__log_fd, in, have);
-                // dprintf(log_fd, &carriage[1], sizeof(char));
-            }
-        }
-        else {
-            defstream.avail_in = size;
-            defstream.next_in = in;
-
-            /* run deflate() on input until output buffer not full, finish
-            compression if all of source has been read in */
-            do {
-                defstream.avail_out = CHUNK;
-                defstream.next_out = out;
-                ret = deflate(&defstream, flush); /* no bad return value */
-                assert(ret != Z_STREAM_ERROR);    /* state not clobbered */
-                have = CHUNK - defstream.avail_out;
-                if (send(__fd2, out, have, 0) != have) {
-                    deflateEnd(&defstream);
-                    return Z_ERRNO;
-                }
-                if (logOpt == 1) {
-                    dprintf(__log_fd, "SENT %d bytes: ", have);
-                    write(__log_fd, out, have);
-                    // dprintf(log_fd, &carriage[1], sizeof(char));
-                }
-            } while (defstream.avail_out == 0);
-            assert(defstream.avail_in == 0); /* all input will be used */
+        if (ret != Z_OK) {
+            deflateEnd(&defstream);
+            return session.enabled ? SESSION_DETACHED : Z_ERRNO;
         }
 
         /* done when last data in file processed */
@@ -191,10 +392,8 @@ int pipe_to_bash(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_fd
 int pipe_to_server(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_fd) {
 
     int ret, size;
-    unsigned have;
-    z_stream infstream;
+    z_stream infstream = {0};
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
 
     if (compressOpt) {
         ret = init_uncompress(&infstream);
@@ -206,6 +405,10 @@ int pipe_to_server(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_
     do {
         memset(in, 0, CHUNK);
         size = recv(__fd1, in, CHUNK, 0);
+        if (size <= 0 && session.enabled) {
+            inflateEnd(&infstream);
+            return SESSION_DETACHED;
+        }
         if (size < 0) {
             fprintf(stderr, "ERROR reading from socket\n");
             inflateEnd(&infstream);
@@ -224,37 +427,18 @@ int pipe_to_server(int __fd1, int __fd2, int compressOpt, int logOpt, int __log_
         }
 
         if (!compressOpt) {
-            have = size;
-            ret = have != CHUNK ? Z_STREAM_END : Z_NO_FLUSH;
-            if (write(__fd2, in, have) != have) {
+            if (show_output(&__fd2, in, size) != Z_OK) {
                 inflateEnd(&infstream);
                 return Z_ERRNO;
             }
+            ret = size != CHUNK ? Z_STREAM_END : Z_NO_FLUSH;
         }
         else {
-            infstream.avail_in = size;
-            infstream.next_in = in;
-
-            /* run inflate() on input until output buffer not full */
-            do {
-                infstream.avail_out = CHUNK;
-                infstream.next_out = out;
-                ret = inflate(&infstream, Z_NO_FLUSH);
-                assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-                switch (ret) {
-                case Z_NEED_DICT:
-                    ret = Z_DATA_ERROR; /* and fall through */
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    inflateEnd(&infstream);
-                    return ret;
-                }
-                have = CHUNK - infstream.avail_out;
-                if (write(__fd2, out, have) != have) {
-                    inflateEnd(&infstream);
-                    return Z_ERRNO;
-                }
-            } while (infstream.avail_out == 0);
+            ret = inflate_frames(&infstream, in, size, CHUNK, show_output, &__fd2);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                inflateEnd(&infstream);
+                return ret;
+            }
         }
 
         /* done when inflate() says it's done */
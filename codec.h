@@ -0,0 +1,115 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <assert.h>
+#include <zlib.h>
+
+#define CHUNK 256
+
+/* Every read is compressed as its own zlib stream, or sent as is without
+   --compress. Reads that fill CHUNK continue the stream into the next
+   read, and each output buffer of deflate() is sent as one frame. The
+   client, the server and the replay tool share the code below. */
+
+/* receives each frame or piece of decompressed output, returns Z_OK to
+   carry on */
+typedef int (*frame_fn)(void *ctx, unsigned char *buf, unsigned n);
+
+int init_compress(z_streamp defstream, int level)
+{
+    int ret;
+
+    /* allocate deflate state */
+    defstream->zalloc = Z_NULL;
+    defstream->zfree = Z_NULL;
+    defstream->opaque = Z_NULL;
+    ret = deflateInit(defstream, level);
+    if (ret != Z_OK)
+        return ret;
+
+    return Z_OK;
+}
+
+int init_uncompress(z_streamp infstream)
+{
+    int ret;
+
+    /* allocate inflate state */
+    infstream->zalloc = Z_NULL;
+    infstream->zfree = Z_NULL;
+    infstream->opaque = Z_NULL;
+    infstream->avail_in = 0;
+    infstream->next_in = Z_NULL;
+    ret = inflateInit(infstream);
+    if (ret != Z_OK)
+        return ret;
+
+    return Z_OK;
+}
+
+int deflate_frames(z_streamp defstream, unsigned char *in, int size, int flush, int chunk, frame_fn emit, void *ctx)
+{
+    int ret;
+    unsigned have;
+    unsigned char out[chunk];
+
+    defstream->avail_in = size;
+    defstream->next_in = in;
+
+    /* run deflate() on input until output buffer not full, finish
+    compression if all of source has been read in */
+    do {
+        defstream->avail_out = chunk;
+        defstream->next_out = out;
+        ret = deflate(defstream, flush); /* no bad return value */
+        assert(ret != Z_STREAM_ERROR);   /* state not clobbered */
+        have = chunk - defstream->avail_out;
+        if (have > 0 && emit(ctx, out, have) != Z_OK)
+            return Z_ERRNO;
+    } while (defstream->avail_out == 0);
+    assert(defstream->avail_in == 0); /* all input will be used */
+
+    return Z_OK;
+}
+
+int inflate_frames(z_streamp infstream, unsigned char *in, int size, int chunk, frame_fn emit, void *ctx)
+{
+    int ret;
+    unsigned have;
+    unsigned char out[chunk];
+
+    infstream->avail_in = size;
+    infstream->next_in = in;
+
+    /* run inflate() on input until output buffer not full */
+    for (;;) {
+        infstream->avail_out = chunk;
+        infstream->next_out = out;
+        ret = inflate(infstream, Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR); /* state not clobbered */
+        switch (ret) {
+        case Z_NEED_DICT:
+            ret = Z_DATA_ERROR;
+            /* fall through */
+        case Z_DATA_ERROR:
+        case Z_MEM_ERROR:
+            return ret;
+        }
+        have = chunk - infstream->avail_out;
+        if (have > 0 && emit(ctx, out, have) != Z_OK)
+            return Z_ERRNO;
+
+        /* the next stream can arrive in the same read */
+        if (ret == Z_STREAM_END && infstream->avail_in > 0) {
+            inflateReset(infstream);
+            continue;
+        }
+        if (infstream->avail_out != 0)
+            break;
+    }
+
+    /* Z_BUF_ERROR only means the rest of the stream is still to come */
+    return ret == Z_BUF_ERROR ? Z_OK : ret;
+}
+
+#endif // CODEC_H
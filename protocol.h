@@ -0,0 +1,58 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* The server opens every connection with a one-byte greeting of GREETING_*
+   flags. With --resume the client then sends a hello of two big-endian
+   u64s, its session token (0 for a new session) and the bytes of output
+   it has shown. The server replies with the token and the offset it
+   replays from, or a token of 0 to refuse. Both ends include this file
+   so the handshake and SESSION_END stay identical. */
+
+#define GREETING_PTY 0x01 // bash runs on a pseudo-terminal that echoes input
+
+#define SESSION_DETACHED 100
+#define SESSION_END "\033]cnc;session-end\007" // OSC sent when the shell exits, ignored by terminals
+#define HANDSHAKE_TIMEOUT 5  // seconds for a hello or its reply
+#define KEEPALIVE_IDLE 10    // seconds of silence before the peer is probed
+#define KEEPALIVE_INTERVAL 5
+#define KEEPALIVE_COUNT 3
+#define USER_TIMEOUT 30000   // milliseconds sent data may go unacknowledged
+
+/* without these a connection that dies silently (NAT timeout, dead
+   path) is only noticed once TCP gives up retransmitting, minutes later */
+void set_keepalive(int __fd)
+{
+    int on = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, count = KEEPALIVE_COUNT;
+    unsigned int timeout = USER_TIMEOUT;
+
+    setsockopt(__fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(__fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(__fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(__fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    setsockopt(__fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+}
+
+void set_recv_timeout(int __fd, int seconds)
+{
+    struct timeval tv = {seconds, 0};
+    setsockopt(__fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+/* returns the server's GREETING_* flags, or -1 */
+int read_greeting(int __fd)
+{
+    unsigned char flags;
+    int n;
+
+    set_recv_timeout(__fd, HANDSHAKE_TIMEOUT);
+    n = recv(__fd, &flags, sizeof(flags), 0);
+    set_recv_timeout(__fd, 0);
+    return n == sizeof(flags) ? flags : -1;
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,132 @@
+#include "replay.h"
+
+#define MAX_SETTINGS 16
+
+int main(int argc, char *argv[])
+{
+
+    struct option options[] = {
+        {"log", no_argument, NULL, 'l'},
+        {"compressed", no_argument, NULL, 'c'},
+        {"level", required_argument, NULL, 'L'},
+        {"chunk", required_argument, NULL, 'k'},
+        {"flush", required_argument, NULL, 'f'},
+        {"bandwidth", required_argument, NULL, 'b'},
+        {"rtt", required_argument, NULL, 'r'},
+        {0, 0, 0, 0}};
+
+    int opt;
+    int logOpt = 0;
+    int compressedOpt = 0;
+    int levels[MAX_SETTINGS] = {1, 6, 9};
+    int chunks[MAX_SETTINGS] = {CHUNK, 1024, 4096};
+    int flushes[MAX_SETTINGS] = {FLUSH_FINISH, FLUSH_SYNC};
+    int nlevels = 3, nchunks = 3, nflushes = 2;
+    double bandwidth = 1000; // kbit/s
+    double rtt = 150;        // milliseconds
+
+    while ((opt = getopt_long(argc, argv, "lcL:k:f:b:r:", options, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            logOpt = 1;
+            break;
+        case 'c':
+            compressedOpt = 1;
+            break;
+        case 'L':
+            nlevels = parse_list(optarg, levels, MAX_SETTINGS);
+            break;
+        case 'k':
+            nchunks = parse_list(optarg, chunks, MAX_SETTINGS);
+            break;
+        case 'f':
+            nflushes = 0;
+            for (char *item = strtok(optarg, ","); item != NULL && nflushes < MAX_SETTINGS; item = strtok(NULL, ",")) {
+                if (strcmp(item, "finish") == 0)
+                    flushes[nflushes++] = FLUSH_FINISH;
+                else if (strcmp(item, "sync") == 0)
+                    flushes[nflushes++] = FLUSH_SYNC;
+                else {
+                    fprintf(stderr, "Unknown flush policy %s: use finish or sync\n", item);
+                    exit(1);
+                }
+            }
+            break;
+        case 'b':
+            bandwidth = atof(optarg);
+            break;
+        case 'r':
+            rtt = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "Incorrect argument: correct usage is ./replay [--log [--compressed]] [--level=1,6,9] [--chunk=256,1024,4096] [--flush=finish,sync] [--bandwidth=kbps] [--rtt=milliseconds] pathname\n");
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Incorrect argument: correct usage is ./replay [--log [--compressed]] [--level=1,6,9] [--chunk=256,1024,4096] [--flush=finish,sync] [--bandwidth=kbps] [--rtt=milliseconds] pathname\n");
+        fprintf(stderr, "trace not specified\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < nlevels; i++)
+        if (levels[i] < 0 || levels[i] > 9) {
+            fprintf(stderr, "Compression level %d out of range 0-9\n", levels[i]);
+            exit(1);
+        }
+    for (int i = 0; i < nchunks; i++)
+        if (chunks[i] <= 0 || chunks[i] > MAX_CHUNK) {
+            fprintf(stderr, "Buffer size %d out of range 1-%d\n", chunks[i], MAX_CHUNK);
+            exit(1);
+        }
+    if (bandwidth <= 0 || rtt < 0) {
+        fprintf(stderr, "Bandwidth must be positive and rtt not negative\n");
+        exit(1);
+    }
+
+    if ((logOpt ? load_log(argv[optind], compressedOpt) : load_trace(argv[optind])) < 0)
+        error("ERROR reading trace");
+
+    long long typed = 0, shown = 0;
+    for (int i = 0; i < nbursts; i++) {
+        if (bursts[i].direction == TRACE_INPUT)
+            typed += bursts[i].length;
+        else
+            shown += bursts[i].length;
+    }
+    printf("%d bursts, %lld bytes typed, %lld bytes shown", nbursts, typed, shown);
+    if (!logOpt && nbursts > 0)
+        printf(" over %.1f s", bursts[nbursts - 1].time / 1e6);
+    printf("\nlink %.0f kbit/s, rtt %.0f ms\n\n", bandwidth, rtt);
+
+    printf("%-5s %5s %6s %-7s %7s %10s %10s %9s %9s %9s\n",
+           "codec", "level", "chunk", "flush", "ratio", "deflate", "inflate", "frames", "latency", "max");
+    printf("%-5s %5s %6s %-7s %7s %10s %10s %9s %9s %9s\n",
+           "", "", "bytes", "", "", "ms/MB", "ms/MB", "", "ms", "ms");
+
+    struct config config;
+    struct result result;
+    int failed = 0;
+
+    for (int k = 0; k < nchunks; k++) {
+        config.compress = 0;
+        config.chunk = chunks[k];
+        simulate(&config, bandwidth * 1000, rtt, &result);
+        print_result(&config, &result);
+        failed |= result.mismatch;
+
+        config.compress = 1;
+        for (int f = 0; f < nflushes; f++) {
+            for (int l = 0; l < nlevels; l++) {
+                config.level = levels[l];
+                config.flush = flushes[f];
+                simulate(&config, bandwidth * 1000, rtt, &result);
+                print_result(&config, &result);
+                failed |= result.mismatch;
+            }
+        }
+    }
+
+    return failed;
+}
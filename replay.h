@@ -0,0 +1,388 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <zlib.h>
+#include "codec.h"
+#include "trace.h"
+
+#define FLUSH_FINISH 0  // every read its own stream, as client and server do
+#define FLUSH_SYNC 1    // one stream per direction, Z_SYNC_FLUSH after each read
+#define FRAME_OVERHEAD 40 // TCP/IP header bytes per frame on the simulated link
+#define COALESCE_US 1000  // trace records closer than this form one burst
+#define MAX_CHUNK 65536   // codec.h keeps a chunk-sized buffer on the stack
+
+/* what one side read in one go, replayed as a single pipe_to_* call */
+struct burst {
+    char direction;
+    long long time; // microseconds since the start of the recording
+    unsigned char *data;
+    int length;
+};
+
+struct config {
+    int compress;
+    int level;
+    int chunk;
+    int flush;
+};
+
+struct result {
+    long long plain;
+    long long wire;
+    long frames;
+    double deflate_time; // CPU seconds
+    double inflate_time;
+    double latency_sum;  // milliseconds
+    double latency_max;
+    long bursts;
+    int mismatch;
+};
+
+struct burst *bursts;
+int nbursts;
+int timed; // bursts carry their recording time, client --log does not
+
+/* growable byte buffer for wire data and decoded output */
+struct buffer {
+    unsigned char *data;
+    int length;
+    int size;
+};
+
+void error(const char *string) {
+    perror(string);
+    exit(1);
+}
+
+int append(void *ctx, unsigned char *buf, unsigned n) {
+    struct buffer *b = ctx;
+
+    if (b->length + (int)n > b->size) {
+        b->size = (b->length + n) * 2;
+        b->data = realloc(b->data, b->size);
+        if (b->data == NULL)
+            error("ERROR allocating buffer");
+    }
+    memcpy(b->data + b->length, buf, n);
+    b->length += n;
+    return Z_OK;
+}
+
+void add_burst(char direction, long long time, const unsigned char *buf, int n, int coalesce) {
+    struct burst *last = nbursts > 0 ? &bursts[nbursts - 1] : NULL;
+
+    if (n <= 0)
+        return;
+
+    if (coalesce && last != NULL && last->direction == direction && time - last->time < COALESCE_US) {
+        last->data = realloc(last->data, last->length + n);
+        if (last->data == NULL)
+            error("ERROR allocating burst");
+        memcpy(last->data + last->length, buf, n);
+        last->length += n;
+        return;
+    }
+
+    bursts = realloc(bursts, (nbursts + 1) * sizeof(struct burst));
+    if (bursts == NULL)
+        error("ERROR allocating burst");
+    bursts[nbursts].direction = direction;
+    bursts[nbursts].time = time;
+    bursts[nbursts].data = malloc(n);
+    if (bursts[nbursts].data == NULL)
+        error("ERROR allocating burst");
+    memcpy(bursts[nbursts].data, buf, n);
+    bursts[nbursts].length = n;
+    nbursts++;
+}
+
+unsigned char *read_file(const char *path, long *length) {
+    unsigned char *data;
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    data = malloc(*length + 1);
+    if (data == NULL || fread(data, 1, *length, file) != (size_t)*length) {
+        fclose(file);
+        free(data);
+        return NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+int load_trace(const char *path) {
+    long length, pos = strlen(TRACE_MAGIC);
+    struct trace_header header;
+    unsigned char *data = read_file(path, &length);
+
+    if (data == NULL)
+        return -1;
+    if (length < pos || memcmp(data, TRACE_MAGIC, pos) != 0) {
+        fprintf(stderr, "%s is not a trace recorded with --record\n", path);
+        exit(1);
+    }
+
+    while (pos + (long)sizeof(header) <= length) {
+        memcpy(&header, data + pos, sizeof(header));
+        pos += sizeof(header);
+        header.length = be32toh(header.length);
+        if (pos + (long)header.length > length)
+            break; // recording was cut short
+        add_burst(header.direction, be64toh(header.time), data + pos, header.length, 1);
+        pos += header.length;
+    }
+
+    timed = 1;
+    free(data);
+    return 0;
+}
+
+/* a zlib header that decodes cleanly: the log was taken with --compress */
+int looks_compressed(const unsigned char *buf, int n) {
+    z_stream strm;
+    struct buffer scratch = {NULL, 0, 0};
+    int ret;
+
+    if (n < 2 || (buf[0] & 0x0f) != Z_DEFLATED || (buf[0] << 8 | buf[1]) % 31 != 0)
+        return 0;
+    if (init_uncompress(&strm) != Z_OK)
+        error("ERROR initializing zlib");
+    ret = inflate_frames(&strm, (unsigned char *)buf, n, CHUNK, append, &scratch);
+    inflateEnd(&strm);
+    free(scratch.data);
+    return ret == Z_OK || ret == Z_STREAM_END;
+}
+
+/* client --log files have no timing, every record becomes its own burst
+   and a compressed log is decoded back to what was typed and shown */
+int load_log(const char *path, int compressed) {
+    long length, n, pos = 0;
+    int ret;
+    char direction;
+    z_stream infstream[2];
+    struct buffer decoded = {NULL, 0, 0};
+    unsigned char *data = read_file(path, &length);
+
+    if (data == NULL)
+        return -1;
+    data[length] = '\0';
+
+    if (compressed && (init_uncompress(&infstream[0]) != Z_OK || init_uncompress(&infstream[1]) != Z_OK))
+        error("ERROR initializing zlib");
+
+    while (pos < length) {
+        char *p = (char *)data + pos, *end;
+
+        /* "SENT n bytes: " or "RECEIVED n bytes: " then exactly n bytes,
+           which may themselves start with whitespace */
+        if (length - pos >= 5 && memcmp(p, "SENT ", 5) == 0) {
+            direction = TRACE_INPUT;
+            p += 5;
+        }
+        else if (length - pos >= 9 && memcmp(p, "RECEIVED ", 9) == 0) {
+            direction = TRACE_OUTPUT;
+            p += 9;
+        }
+        else
+            p = NULL;
+
+        end = NULL;
+        if (p != NULL && *p >= '0' && *p <= '9')
+            n = strtol(p, &end, 10);
+        if (end == NULL || strncmp(end, " bytes: ", 8) != 0) {
+            fprintf(stderr, "%s: unexpected log record at byte %ld\n", path, pos);
+            exit(1);
+        }
+        pos = end + 8 - (char *)data;
+        if (n > length - pos)
+            break; // log was cut short
+
+        if (!compressed) {
+            if (nbursts == 0 && looks_compressed(data + pos, n)) {
+                fprintf(stderr, "%s was taken with --compress, load it with --log --compressed\n", path);
+                exit(1);
+            }
+            add_burst(direction, 0, data + pos, n, 0);
+        }
+        else {
+            decoded.length = 0;
+            ret = inflate_frames(&infstream[direction == TRACE_OUTPUT], data + pos, n, CHUNK, append, &decoded);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                fprintf(stderr, "%s: record at byte %ld does not decompress, was the log taken with --compress?\n", path, pos);
+                exit(1);
+            }
+            add_burst(direction, 0, decoded.data, decoded.length, 0);
+        }
+        pos += n;
+    }
+
+    if (compressed) {
+        inflateEnd(&infstream[0]);
+        inflateEnd(&infstream[1]);
+    }
+    free(decoded.data);
+    free(data);
+    return 0;
+}
+
+double cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* replays every burst through the same framing as pipe_to_bash() and
+   pipe_to_server(), decodes it again as the peer would and charges the
+   wire bytes to a link of the given bandwidth and round-trip time */
+void simulate(struct config *config, double bandwidth, double rtt, struct result *result) {
+    int size, flush;
+    double start, deflate_cpu, inflate_cpu;
+    double link_free[2] = {0, 0}; // microseconds
+    z_stream defstream[2], infstream[2];
+    struct buffer wire = {NULL, 0, 0};
+    struct buffer decoded = {NULL, 0, 0};
+
+    memset(result, 0, sizeof(*result));
+
+    if (config->compress && config->flush == FLUSH_SYNC) {
+        for (int d = 0; d < 2; d++)
+            if (init_compress(&defstream[d], config->level) != Z_OK || init_uncompress(&infstream[d]) != Z_OK)
+                error("ERROR initializing zlib");
+    }
+
+    for (int i = 0; i < nbursts; i++) {
+        struct burst *b = &bursts[i];
+        int d = b->direction == TRACE_OUTPUT;
+        long frames = 0;
+
+        wire.length = 0;
+        decoded.length = 0;
+
+        /* sender: read chunk bytes at a time, as the pipe_* loops do */
+        start = cpu_time();
+        if (config->compress && config->flush == FLUSH_FINISH && init_compress(&defstream[d], config->level) != Z_OK)
+            error("ERROR initializing zlib");
+        for (int pos = 0; pos < b->length; pos += size) {
+            size = b->length - pos < config->chunk ? b->length - pos : config->chunk;
+
+            if (!config->compress) {
+                append(&wire, b->data + pos, size);
+                frames++;
+                continue;
+            }
+
+            int last = pos + size == b->length;
+            if (config->flush == FLUSH_FINISH)
+                flush = last ? Z_FINISH : Z_NO_FLUSH;
+            else
+                flush = last ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+            int before = wire.length;
+            deflate_frames(&defstream[d], b->data + pos, size, flush, config->chunk, append, &wire);
+            // every output buffer deflate_frames() hands over is one send()
+            frames += (wire.length - before + config->chunk - 1) / config->chunk;
+        }
+        if (config->compress && config->flush == FLUSH_FINISH)
+            deflateEnd(&defstream[d]);
+        deflate_cpu = cpu_time() - start;
+
+        /* receiver: recv() chunk bytes at a time and decode */
+        start = cpu_time();
+        if (!config->compress) {
+            append(&decoded, wire.data, wire.length);
+        }
+        else {
+            if (config->flush == FLUSH_FINISH && init_uncompress(&infstream[d]) != Z_OK)
+                error("ERROR initializing zlib");
+            for (int pos = 0; pos < wire.length; pos += size) {
+                size = wire.length - pos < config->chunk ? wire.length - pos : config->chunk;
+                int ret = inflate_frames(&infstream[d], wire.data + pos, size, config->chunk, append, &decoded);
+                if (ret != Z_OK && ret != Z_STREAM_END)
+                    result->mismatch = 1;
+            }
+            if (config->flush == FLUSH_FINISH)
+                inflateEnd(&infstream[d]);
+        }
+        inflate_cpu = cpu_time() - start;
+
+        if (decoded.length != b->length || memcmp(decoded.data, b->data, b->length) != 0)
+            result->mismatch = 1;
+
+        /* latency: compress, wait for the link, transmit, half a round trip,
+           decompress; untimed bursts arrive once the link is idle again */
+        double arrival = timed ? b->time : link_free[d];
+        double ready = arrival + deflate_cpu * 1e6;
+        double sent = (ready > link_free[d] ? ready : link_free[d]);
+        sent += (wire.length + frames * FRAME_OVERHEAD) * 8 * 1e6 / bandwidth;
+        link_free[d] = sent;
+        double latency = (sent + rtt * 1e3 / 2 + inflate_cpu * 1e6 - arrival) / 1e3;
+
+        result->plain += b->length;
+        result->wire += wire.length;
+        result->frames += frames;
+        result->deflate_time += deflate_cpu;
+        result->inflate_time += inflate_cpu;
+        result->latency_sum += latency;
+        if (latency > result->latency_max)
+            result->latency_max = latency;
+        result->bursts++;
+    }
+
+    if (config->compress && config->flush == FLUSH_SYNC) {
+        for (int d = 0; d < 2; d++) {
+            deflateEnd(&defstream[d]);
+            inflateEnd(&infstream[d]);
+        }
+    }
+    free(wire.data);
+    free(decoded.data);
+}
+
+void print_result(struct config *config, struct result *result) {
+    double mb = result->plain / 1e6;
+
+    if (!config->compress)
+        printf("%-5s %5s %6d %-7s", "off", "-", config->chunk, "-");
+    else
+        printf("%-5s %5d %6d %-7s", "zlib", config->level, config->chunk, config->flush == FLUSH_FINISH ? "finish" : "sync");
+
+    printf(" %7.2f %10.1f %10.1f %9ld %9.1f %9.1f%s\n",
+           result->wire > 0 ? (double)result->plain / result->wire : 1.0,
+           mb > 0 ? result->deflate_time * 1e3 / mb : 0.0,
+           mb > 0 ? result->inflate_time * 1e3 / mb : 0.0,
+           result->frames,
+           result->bursts > 0 ? result->latency_sum / result->bursts : 0.0,
+           result->latency_max,
+           result->mismatch ? "  CHECK FAILED" : "");
+}
+
+int parse_list(char *list, int *values, int max) {
+    int n = 0;
+    long value;
+    char *end;
+
+    for (char *item = strtok(list, ","); item != NULL && n < max; item = strtok(NULL, ",")) {
+        value = strtol(item, &end, 10);
+        values[n++] = value;
+        if (end == item || *end != '\0' || values[n - 1] != value) {
+            fprintf(stderr, "%s is not a valid number\n", item);
+            exit(1);
+        }
+    }
+    return n;
+}
+
+#endif // REPLAY_H
@@ -0,0 +1,380 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+#define FRAME_MAX (SCREEN_ROWS * (SCREEN_COLS + 16) + 32)
+
+struct grid {
+    unsigned char cells[SCREEN_ROWS][SCREEN_COLS];
+    int row, col;
+};
+
+/* screen synchronization (--sync): shell output is applied to a model of
+   the terminal and only the difference to what the client shows is sent */
+struct screen {
+    int enabled;
+    int interval;  // milliseconds between frames
+    int dirty;     // current differs from what was last sent
+    int valid;     // client shows `sent`, otherwise redraw everything
+    int alternate; // full-screen program, main screen kept in `saved`
+    int state;     // escape sequence parser
+    char args[32];
+    int nargs;
+    int top, bottom; // scroll region, inclusive rows
+    int saved_row, saved_col; // ESC 7 / CSI s
+    long long last_frame;
+    struct grid current;
+    struct grid sent;
+    struct grid saved;
+} screen;
+
+void grid_clear(struct grid *g, int row, int from, int to) {
+    if (from < to)
+        memset(&g->cells[row][from], ' ', to - from);
+}
+
+void grid_erase(struct grid *g) {
+    memset(g->cells, ' ', sizeof(g->cells));
+}
+
+void screen_init() {
+    grid_erase(&screen.current);
+    grid_erase(&screen.sent);
+    screen.current.row = screen.current.col = 0;
+    screen.top = 0;
+    screen.bottom = SCREEN_ROWS - 1;
+    screen.saved_row = screen.saved_col = 0;
+    screen.valid = 0;
+    screen.dirty = 1;
+}
+
+/* scrolls rows from..to (inclusive) up by n, or down for negative n */
+void grid_scroll(struct grid *g, int from, int to, int n) {
+    int height = to - from + 1;
+
+    if (n > height)
+        n = height;
+    if (n < -height)
+        n = -height;
+
+    if (n > 0) {
+        memmove(g->cells[from], g->cells[from + n], (height - n) * SCREEN_COLS);
+        for (int r = to - n + 1; r <= to; r++)
+            grid_clear(g, r, 0, SCREEN_COLS);
+    }
+    else if (n < 0) {
+        memmove(g->cells[from - n], g->cells[from], (height + n) * SCREEN_COLS);
+        for (int r = from; r < from - n; r++)
+            grid_clear(g, r, 0, SCREEN_COLS);
+    }
+}
+
+void screen_linefeed() {
+    struct grid *g = &screen.current;
+
+    // only the bottom margin scrolls, below the region the cursor just moves
+    if (g->row == screen.bottom)
+        grid_scroll(g, screen.top, screen.bottom, 1);
+    else if (g->row < SCREEN_ROWS - 1)
+        g->row++;
+}
+
+void screen_reverse_index() {
+    struct grid *g = &screen.current;
+
+    if (g->row == screen.top)
+        grid_scroll(g, screen.top, screen.bottom, -1);
+    else if (g->row > 0)
+        g->row--;
+}
+
+int screen_arg(int index, int fallback) {
+    const char *p = screen.args;
+
+    if (*p == '?')
+        p++;
+    for (int i = 0; i < index && p != NULL; i++) {
+        p = strchr(p, ';');
+        if (p != NULL)
+            p++;
+    }
+    if (p == NULL || *p < '0' || *p > '9')
+        return fallback;
+    return atoi(p);
+}
+
+void screen_csi(unsigned char final) {
+    struct grid *g = &screen.current;
+    int n = screen_arg(0, 1) > 0 ? screen_arg(0, 1) : 1;
+    int mode = screen_arg(0, 0);
+
+    // cursor movement and editing cancel a pending wrap, SGR and modes keep it
+    if (g->col >= SCREEN_COLS && strchr("ABCDGHfdJKXP@LM", final) != NULL)
+        g->col = SCREEN_COLS - 1;
+
+    switch (final) {
+    case 'A':
+        g->row -= n;
+        break;
+    case 'B':
+        g->row += n;
+        break;
+    case 'C':
+        g->col += n;
+        break;
+    case 'D':
+        g->col -= n;
+        break;
+    case 'G':
+        g->col = n - 1;
+        break;
+    case 'd':
+        g->row = n - 1;
+        break;
+    case 'H':
+    case 'f':
+        g->row = screen_arg(0, 1) - 1;
+        g->col = screen_arg(1, 1) - 1;
+        break;
+    case 'J':
+        if (mode == 0) {
+            grid_clear(g, g->row, g->col, SCREEN_COLS);
+            for (int r = g->row + 1; r < SCREEN_ROWS; r++)
+                grid_clear(g, r, 0, SCREEN_COLS);
+        }
+        else if (mode == 1) {
+            for (int r = 0; r < g->row; r++)
+                grid_clear(g, r, 0, SCREEN_COLS);
+            grid_clear(g, g->row, 0, g->col + 1);
+        }
+        else {
+            grid_erase(g);
+        }
+        break;
+    case 'K':
+        if (mode == 0)
+            grid_clear(g, g->row, g->col, SCREEN_COLS);
+        else if (mode == 1)
+            grid_clear(g, g->row, 0, g->col + 1);
+        else
+            grid_clear(g, g->row, 0, SCREEN_COLS);
+        break;
+    case 'X':
+        n = n < SCREEN_COLS - g->col ? n : SCREEN_COLS - g->col;
+        grid_clear(g, g->row, g->col, g->col + n);
+        break;
+    case 'P':
+        n = n < SCREEN_COLS - g->col ? n : SCREEN_COLS - g->col;
+        memmove(&g->cells[g->row][g->col], &g->cells[g->row][g->col + n], SCREEN_COLS - g->col - n);
+        grid_clear(g, g->row, SCREEN_COLS - n, SCREEN_COLS);
+        break;
+    case '@':
+        n = n < SCREEN_COLS - g->col ? n : SCREEN_COLS - g->col;
+        memmove(&g->cells[g->row][g->col + n], &g->cells[g->row][g->col], SCREEN_COLS - g->col - n);
+        grid_clear(g, g->row, g->col, g->col + n);
+        break;
+    case 'L':
+        if (g->row >= screen.top && g->row <= screen.bottom)
+            grid_scroll(g, g->row, screen.bottom, -n);
+        break;
+    case 'M':
+        if (g->row >= screen.top && g->row <= screen.bottom)
+            grid_scroll(g, g->row, screen.bottom, n);
+        break;
+    case 'S':
+        grid_scroll(g, screen.top, screen.bottom, n);
+        break;
+    case 'T':
+        grid_scroll(g, screen.top, screen.bottom, -n);
+        break;
+    case 'r':
+        if (screen.args[0] == '?')
+            break;
+        if (screen_arg(0, 1) < screen_arg(1, SCREEN_ROWS) && screen_arg(1, SCREEN_ROWS) <= SCREEN_ROWS) {
+            screen.top = (screen_arg(0, 1) > 0 ? screen_arg(0, 1) : 1) - 1;
+            screen.bottom = screen_arg(1, SCREEN_ROWS) - 1;
+            g->row = g->col = 0;
+        }
+        break;
+    case 's':
+        if (screen.args[0] != '?') {
+            screen.saved_row = g->row;
+            screen.saved_col = g->col;
+        }
+        break;
+    case 'u':
+        if (screen.args[0] != '?') {
+            g->row = screen.saved_row;
+            g->col = screen.saved_col;
+        }
+        break;
+    case 'h':
+    case 'l':
+        if (screen.args[0] == '?' && (mode == 1049 || mode == 1047 || mode == 47)) {
+            if (final == 'h' && !screen.alternate) {
+                screen.saved = *g;
+                grid_erase(g);
+                screen.alternate = 1;
+            }
+            else if (final == 'l' && screen.alternate) {
+                *g = screen.saved;
+                screen.alternate = 0;
+            }
+        }
+        break;
+    default: // colours and modes are not modelled
+        break;
+    }
+
+    if (g->row < 0)
+        g->row = 0;
+    if (g->row >= SCREEN_ROWS)
+        g->row = SCREEN_ROWS - 1;
+    if (g->col < 0)
+        g->col = 0;
+    // cursor movement and editing cancel a pending wrap, SGR and modes keep it
+    if (g->col >= SCREEN_COLS && strchr("ABCDGHfdJKXP@LM", final) != NULL)
+        g->col = SCREEN_COLS - 1;
+}
+
+void screen_feed(const unsigned char *buf, int n) {
+    struct grid *g = &screen.current;
+
+    for (int i = 0; i < n; i++) {
+        unsigned char c = buf[i];
+
+        switch (screen.state) {
+        case 1: // ESC
+            screen.state = 0;
+            if (c == '[') {
+                screen.state = 2;
+                screen.nargs = 0;
+                screen.args[0] = '\0';
+            }
+            else if (c == ']')
+                screen.state = 3;
+            else if (c == '(' || c == ')')
+                screen.state = 4;
+            else if (c == 'c')
+                screen_init();
+            else if (c == 'D')
+                screen_linefeed();
+            else if (c == 'E') {
+                g->col = 0;
+                screen_linefeed();
+            }
+            else if (c == 'M')
+                screen_reverse_index();
+            else if (c == '7') {
+                screen.saved_row = g->row;
+                screen.saved_col = g->col;
+            }
+            else if (c == '8') {
+                g->row = screen.saved_row;
+                g->col = screen.saved_col;
+            }
+            continue;
+        case 2: // CSI parameters up to the final byte
+            if (c >= 0x40 && c <= 0x7e) {
+                screen.state = 0;
+                screen_csi(c);
+            }
+            else if (screen.nargs < (int)sizeof(screen.args) - 1) {
+                screen.args[screen.nargs++] = c;
+                screen.args[screen.nargs] = '\0';
+            }
+            continue;
+        case 3: // OSC (window title) up to BEL or ESC
+            if (c == 0x07)
+                screen.state = 0;
+            else if (c == 0x1b)
+                screen.state = 1;
+            continue;
+        case 4: // character set designation
+            screen.state = 0;
+            continue;
+        }
+
+        switch (c) {
+        case 0x1b:
+            screen.state = 1;
+            break;
+        case '\r':
+            g->col = 0;
+            break;
+        case '\n': // the client terminal turns \n into \r\n
+            g->col = 0;
+            screen_linefeed();
+            break;
+        case '\b':
+            if (g->col >= SCREEN_COLS)
+                g->col = SCREEN_COLS - 1;
+            if (g->col > 0)
+                g->col--;
+            break;
+        case '\t':
+            g->col = (g->col + 8) & ~7;
+            if (g->col >= SCREEN_COLS)
+                g->col = SCREEN_COLS - 1;
+            break;
+        default:
+            // UTF-8 continuation bytes belong to the cell of their lead byte
+            if (c < 0x20 || c == 0x7f || (c >= 0x80 && c < 0xc0))
+                break;
+            if (g->col >= SCREEN_COLS) {
+                g->col = 0;
+                screen_linefeed();
+            }
+            // cells are single bytes, anything outside ASCII is shown as '?'
+            g->cells[g->row][g->col++] = c < 0x80 ? c : '?';
+            break;
+        }
+    }
+    screen.dirty = 1;
+}
+
+int screen_frame(unsigned char *out) {
+    struct grid *cur = &screen.current;
+    struct grid *old = &screen.sent;
+    int len = 0;
+
+    if (!screen.valid) {
+        len += sprintf((char *)out, "\033[H\033[2J");
+        grid_erase(old);
+    }
+
+    /* redraw each changed row from its first differing cell */
+    for (int r = 0; r < SCREEN_ROWS; r++) {
+        int first = 0, last = SCREEN_COLS - 1, old_last = SCREEN_COLS - 1;
+
+        while (first < SCREEN_COLS && cur->cells[r][first] == old->cells[r][first])
+            first++;
+        if (first == SCREEN_COLS)
+            continue;
+        while (last >= first && cur->cells[r][last] == ' ')
+            last--;
+        while (old_last >= first && old->cells[r][old_last] == ' ')
+            old_last--;
+
+        len += sprintf((char *)out + len, "\033[%d;%dH", r + 1, first + 1);
+        if (last >= first) {
+            memcpy(out + len, &cur->cells[r][first], last - first + 1);
+            len += last - first + 1;
+        }
+        if (old_last > last)
+            len += sprintf((char *)out + len, "\033[K");
+    }
+    len += sprintf((char *)out + len, "\033[%d;%dH", cur->row + 1, cur->col + 1);
+
+    *old = *cur;
+    screen.valid = 1;
+    screen.dirty = 0;
+    return len;
+}
+
+#endif // SCREEN_H
@@ -3,19 +3,26 @@
 int main(int argc, char *argv[])
 {
 
-    int portno, clilen;
-    struct sockaddr_in serv_addr, cli_addr;
+    int portno;
+    struct sockaddr_in serv_addr;
 
     struct option options[] = {
         {"port", required_argument, NULL, 'p'},
         {"compress", no_argument, NULL, 'c'},
+        {"pty", no_argument, NULL, 't'},
+        {"resume", required_argument, NULL, 'r'},
+        {"sync", required_argument, NULL, 's'},
+        {"hibernate", required_argument, NULL, 'i'},
+        {"metrics", required_argument, NULL, 'm'},
         {0, 0, 0, 0}};
 
     int opt;
     int portOpt = 0;
     int compressOpt = 0;
+    int ptyOpt = 0;
+    char *pty_name = NULL;
 
-    while ((opt = getopt_long(argc, argv, "p:c", options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "p:ctr:s:i:m:", options, NULL)) != -1) {
         switch (opt) {
         case 'p':
             portno = atoi(optarg);
@@ -24,18 +31,42 @@ int main(int argc, char *argv[])
         case 'c':
             compressOpt = 1;
             break;
+        case 't':
+            ptyOpt = 1;
+            greeting |= GREETING_PTY;
+            break;
+        case 'r':
+            session.enabled = 1;
+            session.grace = atoi(optarg);
+            break;
+        case 's':
+            screen.enabled = 1;
+            screen.interval = atoi(optarg);
+            screen_init();
+            break;
+        case 'i':
+            session.idle = atoi(optarg);
+            break;
+        case 'm':
+            session.metrics = optarg;
+            break;
         default:
-            fprintf(stderr, "Incorrect argument: correct usage is ./server --port=portno [--compress]\n");
+            fprintf(stderr, "Incorrect argument: correct usage is ./server --port=portno [--compress] [--pty] [--resume=seconds] [--sync=milliseconds] [--hibernate=seconds] [--metrics=pathname]\n");
             exit(1);
         }
     }
 
     if (!portOpt) {
-        fprintf(stderr, "Incorrect argument: correct usage is ./server --port=portno [--compress]\n");
+        fprintf(stderr, "Incorrect argument: correct usage is ./server --port=portno [--compress] [--pty] [--resume=seconds] [--sync=milliseconds] [--hibernate=seconds] [--metrics=pathname]\n");
         fprintf(stderr, "port not specified\n");
         exit(1);
     }
 
+    if (session.idle > 0 && !session.enabled) {
+        fprintf(stderr, "--hibernate needs --resume, only the replay buffer is given back\n");
+        exit(1);
+    }
+
     socket_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (socket_fd < 0)
         error("ERROR opening socket");
@@ -51,16 +82,32 @@ int main(int argc, char *argv[])
     if (listen(socket_fd, 5) < 0)
         error("ERROR while listening");
 
-    clilen = sizeof(cli_addr);
-    new_socket = accept(socket_fd, (struct sockaddr *)&cli_addr, (socklen_t *)&clilen);
+    if (session.enabled)
+        new_socket = wait_for_client(compressOpt);
+    else
+        new_socket = accept(socket_fd, NULL, NULL);
     if (new_socket < 0)
         error("ERROR on accept");
+    if (!session.enabled && send(new_socket, &greeting, sizeof(greeting), 0) != sizeof(greeting))
+        error("ERROR greeting the client");
 
     signal(SIGINT, sig_handler);
-    signal(SIGPIPE, sig_handler);
+    // with --resume a dead connection is reported by send() instead
+    signal(SIGPIPE, session.enabled ? SIG_IGN : sig_handler);
 
-    pipe(fd0);
-    pipe(fd1);
+    if (ptyOpt) {
+        pty_fd = open_pty(&pty_name);
+        if (pty_fd < 0)
+            error("ERROR opening pseudo-terminal");
+        if (screen.enabled) { // let programs lay out for the modelled screen
+            struct winsize ws = {SCREEN_ROWS, SCREEN_COLS, 0, 0};
+            ioctl(pty_fd, TIOCSWINSZ, &ws);
+        }
+    }
+    else {
+        pipe(fd0);
+        pipe(fd1);
+    }
 
     pid = fork();
     if (pid < 0) {
@@ -71,7 +118,26 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    if (pid == 0) { // child
+    if (pid == 0 && ptyOpt) { // child on a terminal, so bash echoes and edits lines
+        setsid();
+        int slave = open(pty_name, O_RDWR);
+        if (slave < 0) {
+            fprintf(stderr, "ERROR opening %s\n", pty_name);
+            exit(1);
+        }
+        close(pty_fd);
+
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        dup2(slave, STDERR_FILENO);
+        close(slave); // already duplicated
+
+        char *arguments[] = {"/bin/bash", (char *)NULL};
+        execvp(arguments[0], arguments);
+        fprintf(stderr, "ERROR in executing shell\n");
+        exit(1);
+    }
+    else if (pid == 0) { // child
         close(fd0[1]);
         close(fd1[0]);
 
@@ -87,43 +153,123 @@ int main(int argc, char *argv[])
         exit(1);
     }
     else {
-        close(fd0[0]);
-        close(fd1[1]);
+        if (ptyOpt) {
+            fd0[1] = pty_fd;
+            fd1[0] = pty_fd;
+        }
+        else {
+            close(fd0[0]);
+            close(fd1[1]);
+        }
 
         atexit(shutdown_socket);
 
-        struct pollfd fds[2];
+        struct pollfd fds[3 + MAX_PENDING];
         fds[0].fd = new_socket;
         fds[0].events = POLLIN | POLLHUP | POLLERR;
 
         fds[1].fd = fd1[0];
         fds[1].events = POLLIN | POLLHUP | POLLERR;
 
+        // with --resume a returning client may replace a connection that
+        // died without the server noticing
+        watch_clients(&fds[2]);
+        if (!session.enabled)
+            fds[2].fd = -1;
+
+        session.last_active = time(NULL);
+        write_metrics();
+
         for (;;) {
 
-            poll(fds, 2, 0);
+            if (session.enabled)
+                watch_clients(&fds[2]);
+            poll(fds, 3 + MAX_PENDING, 0);
 
-            if (fds[0].revents & POLLIN) {
-                int ret;
-                ret = pipe_to_bash(new_socket, fd0[1], compressOpt);
-                if (ret != Z_OK)
-                    exit(ret);
+            if ((fds[0].revents | fds[1].revents | fds[2].revents) & POLLIN) {
+                session.last_active = time(NULL);
+                if (session.hibernated)
+                    wake_session();
+            }
+            else if (session.idle > 0 && !session.hibernated && time(NULL) - session.last_active > session.idle) {
+                hibernate_session();
             }
 
-            if (fds[0].revents & (POLLHUP | POLLERR)) {
+            if (new_socket >= 0) {
+                if (fds[0].revents & POLLIN) {
+                    int ret;
+                    ret = pipe_to_bash(new_socket, fd0[1], compressOpt);
+                    if (ret == SESSION_DETACHED) {
+                        detach_client();
+                        fds[0].fd = -1;
+                    }
+                    else if (ret != Z_OK)
+                        exit(ret);
+                }
+
+                if (new_socket >= 0 && (fds[0].revents & (POLLHUP | POLLERR))) {
+                    if (!session.enabled)
+                        exit(0);
+                    detach_client();
+                    fds[0].fd = -1;
+                }
+            }
+
+            if (session.enabled) {
+                int fd = poll_clients(&fds[2], compressOpt);
+                if (fd >= 0) {
+                    if (new_socket >= 0) {
+                        fprintf(stderr, "Client reconnected, dropping its old connection\n");
+                        close(new_socket);
+                    }
+                    else
+                        fprintf(stderr, "Client reattached\n");
+                    new_socket = fd;
+                    fds[0].fd = new_socket;
+                }
+            }
+
+            if (new_socket < 0 && time(NULL) - session.detached_at >= session.grace) {
+                fprintf(stderr, "Session expired\n");
+                kill(pid, SIGHUP);
                 exit(0);
             }
 
             if (fds[1].revents & POLLIN) {
                 int ret;
-                ret = pipe_to_server(fd1[0], new_socket, compressOpt);
-                if (ret != Z_OK)
+                if (screen.enabled)
+                    ret = pipe_to_screen(fd1[0]);
+                else
+                    ret = pipe_to_server(fd1[0], new_socket, compressOpt);
+                if (ret == SESSION_DETACHED) {
+                    detach_client();
+                    fds[0].fd = -1;
+                }
+                else if (ret != Z_OK)
+                    exit(ret);
+            }
+
+            if (screen.enabled && screen.dirty && new_socket >= 0 && now_ms() - screen.last_frame >= screen.interval) {
+                int ret;
+                ret = send_frame(new_socket, compressOpt);
+                if (ret == SESSION_DETACHED) {
+                    detach_client();
+                    fds[0].fd = -1;
+                }
+                else if (ret != Z_OK)
                     exit(ret);
             }
 
             if (fds[1].revents & (POLLHUP | POLLERR)) {
+                // show the final screen before closing
+                if (screen.enabled && screen.dirty && new_socket >= 0)
+                    send_frame(new_socket, compressOpt);
+                // a --resume client would take the close for a network drop
+                if (session.enabled && new_socket >= 0)
+                    send_buffer(new_socket, (unsigned char *)SESSION_END, strlen(SESSION_END), compressOpt);
                 // closing the connected socket
-                shutdown(new_socket, SHUT_WR);
+                if (new_socket >= 0)
+                    shutdown(new_socket, SHUT_WR);
                 exit(0);
             }
         }
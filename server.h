@@ -1,6 +1,7 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
@@ -13,14 +14,55 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <linux/sockios.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
 #include <zlib.h>
+#include "codec.h"
+#include "protocol.h"
+#include "screen.h"
 
-#define CHUNK 256
+#define REPLAY_SIZE 65536
+#define MAX_PENDING 4 // connections allowed to owe their hello at once
 
 pid_t pid;
 int fd0[2], fd1[2];
 int socket_fd, new_socket;
+int pty_fd = -1;
+unsigned char greeting; // GREETING_* flags sent to every connection
+
+/* detachable session (--resume): the shell outlives the connection and
+   recent output is kept so a returning client gets what it missed */
+struct session {
+    int enabled;
+    int grace; // seconds to wait for the client to come back
+    time_t detached_at;
+    uint64_t token;
+    uint64_t produced;    // bytes of shell output so far
+    uint64_t reset_point; // replay cannot go back further than this
+    unsigned char *replay; // last REPLAY_SIZE bytes, allocated on demand
+
+    /* idle hibernation (--hibernate) */
+    int idle; // seconds without traffic before memory is given back
+    int hibernated;
+    int hibernations;
+    time_t last_active;
+    const char *metrics; // --metrics file, rewritten on every change
+} session;
+
+/* a connection accepted with --resume, its hello is read as it arrives
+   so a silent one never holds up the shell */
+struct pending {
+    int active;
+    int fd;
+    time_t since;
+    unsigned have; // bytes of the hello received
+    uint64_t hello[2];
+} pending[MAX_PENDING];
 
 void error(const char *string) {
     perror(string);
@@ -53,6 +95,12 @@ void sanitization(int __fd, const void *__buf, size_t __n)
     char *input = (char *)__buf;
     char carriage[2] = {'\r', '\n'};
 
+    if (pty_fd >= 0) {
+        // the terminal line discipline handles newlines, ^C and ^D itself
+        write(__fd, __buf, __n);
+        return;
+    }
+
     for (size_t i = 0; i < __n; i++) {
         char curr = input[i];
         switch (curr) {
@@ -81,45 +129,147 @@ void sanitization(int __fd, const void *__buf, size_t __n)
     }
 }
 
-int init_compress(z_streamp defstream)
+uint64_t new_token()
 {
-    int ret;
+    uint64_t token = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd >= 0) {
+        read(fd, &token, sizeof(token));
+        close(fd);
+    }
+    if (token == 0)
+        token = ((uint64_t)time(NULL) << 32) ^ getpid();
+    return token;
+}
 
-    /* allocate deflate state */
-    defstream->zalloc = Z_NULL;
-    defstream->zfree = Z_NULL;
-    defstream->opaque = Z_NULL;
-    ret = deflateInit(defstream, Z_DEFAULT_COMPRESSION);
-    if (ret != Z_OK)
-        return ret;
+uint64_t replay_start()
+{
+    uint64_t start = session.produced > REPLAY_SIZE ? session.produced - REPLAY_SIZE : 0;
+    return start > session.reset_point ? start : session.reset_point;
+}
 
-    return Z_OK;
+/* buffers the session holds on to between bursts of traffic */
+long session_resident_bytes()
+{
+    long bytes = 0;
+
+    if (session.replay != NULL)
+        bytes += REPLAY_SIZE;
+    if (screen.enabled)
+        bytes += sizeof(screen);
+    return bytes;
 }
 
-int init_uncompress(z_streamp infstream)
+long process_resident_bytes()
 {
-    int ret;
-
-    /* allocate inflate state */
-    infstream->zalloc = Z_NULL;
-    infstream->zfree = Z_NULL;
-    infstream->opaque = Z_NULL;
-    infstream->avail_in = 0;
-    infstream->next_in = Z_NULL;
-    ret = inflateInit(infstream);
-    if (ret != Z_OK)
-        return ret;
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%*s %ld", &pages) != 1)
+        pages = 0;
+    fclose(statm);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+void write_metrics()
+{
+    FILE *file;
+
+    if (session.metrics == NULL)
+        return;
+
+    file = fopen(session.metrics, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to write metrics. Error: %d, Message: %s\n", errno, strerror(errno));
+        return;
+    }
+    fprintf(file, "# HELP session_resident_bytes Memory held by the session between bursts of traffic.\n");
+    fprintf(file, "# TYPE session_resident_bytes gauge\n");
+    fprintf(file, "session_resident_bytes %ld\n", session_resident_bytes());
+    fprintf(file, "# HELP process_resident_memory_bytes Resident set size of the server process.\n");
+    fprintf(file, "# TYPE process_resident_memory_bytes gauge\n");
+    fprintf(file, "process_resident_memory_bytes %ld\n", process_resident_bytes());
+    fprintf(file, "# HELP session_hibernated 1 while the session is hibernated and its replay buffer freed.\n");
+    fprintf(file, "# TYPE session_hibernated gauge\n");
+    fprintf(file, "session_hibernated %d\n", session.hibernated);
+    fprintf(file, "# HELP session_hibernations_total Times the session was hibernated after sitting idle.\n");
+    fprintf(file, "# TYPE session_hibernations_total counter\n");
+    fprintf(file, "session_hibernations_total %d\n", session.hibernations);
+    fclose(file);
+}
+
+void replay_record(const unsigned char *buf, int n)
+{
+    if (session.replay == NULL) {
+        session.replay = malloc(REPLAY_SIZE);
+        if (session.replay == NULL)
+            error("ERROR allocating replay buffer");
+        write_metrics();
+    }
+
+    for (int i = 0; i < n; i++)
+        session.replay[(session.produced + i) % REPLAY_SIZE] = buf[i];
+    session.produced += n;
+}
+
+void hibernate_session()
+{
+    int unacked;
+
+    /* the ring may only go once the client has acknowledged all output,
+       resuming then starts at the reset point */
+    if (session.replay == NULL || new_socket < 0 || ioctl(new_socket, SIOCOUTQ, &unacked) < 0 || unacked > 0)
+        return;
+
+    free(session.replay);
+    session.replay = NULL;
+    session.reset_point = session.produced;
+    session.hibernated = 1;
+    session.hibernations++;
+
+    fprintf(stderr, "Session hibernated, %ld bytes resident\n", session_resident_bytes());
+    write_metrics();
+}
+
+void wake_session()
+{
+    session.hibernated = 0;
+    fprintf(stderr, "Session woke up\n");
+    write_metrics();
+}
+
+int open_pty(char **slave_name)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0)
+        return -1;
+
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0 || (*slave_name = ptsname(fd)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
 
+int to_bash(void *ctx, unsigned char *buf, unsigned n) {
+    sanitization(*(int *)ctx, buf, n);
+    return Z_OK;
+}
+
+int to_socket(void *ctx, unsigned char *buf, unsigned n) {
+    if (send(*(int *)ctx, buf, n, 0) != n)
+        return Z_ERRNO;
     return Z_OK;
 }
 
 int pipe_to_bash(int __fd1, int __fd2, int compressOpt) {
 
     int ret, size;
-    unsigned have;
-    z_stream infstream;
+    z_stream infstream = {0};
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
 
     if (compressOpt) {
         ret = init_uncompress(&infstream);
@@ -131,6 +281,10 @@ int pipe_to_bash(int __fd1, int __fd2, int compressOpt) {
     do {
         memset(in, 0, CHUNK);
         size = recv(__fd1, in, CHUNK, 0);
+        if (size <= 0 && session.enabled) {
+            inflateEnd(&infstream);
+            return SESSION_DETACHED;
+        }
         if (size < 0) {
             fprintf(stderr, "ERROR reading from new_socket\n");
             inflateEnd(&infstream);
@@ -143,35 +297,15 @@ int pipe_to_bash(int __fd1, int __fd2, int compressOpt) {
         }
 
         if (!compressOpt) {
-            have = size;
-            ret = have != CHUNK ? Z_STREAM_END : Z_NO_FLUSH;
-            sanitization(__fd2, in, have);
+            ret = size != CHUNK ? Z_STREAM_END : Z_NO_FLUSH;
+            sanitization(__fd2, in, size);
         }
         else {
-            infstream.avail_in = size;
-            infstream.next_in = in;
-
-            /* run inflate() on input until output buffer not full */
-            do {
-                infstream.avail_out = CHUNK;
-                infstream.next_out = out;
-                ret = inflate(&infstream, Z_NO_FLUSH);
-                assert(ret != Z_STREAM_ERROR); /* state not clobbered */
-                switch (ret) {
-                case Z_NEED_DICT:
-                    ret = Z_DATA_ERROR; /* and fall through */
-                case Z_DATA_ERROR:
-                case Z_MEM_ERROR:
-                    inflateEnd(&infstream);
-                    return ret;
-                }
-                have = CHUNK - infstream.avail_out;
-                // if (write(__fd2, out, have) != have) {
-                //     inflateEnd(&infstream);
-                //     // return Z_ERRNO;
-                // }
-                sanitization(__fd2, out, have);
-            } while (infstream.avail_out == 0);
+            ret = inflate_frames(&infstream, in, size, CHUNK, to_bash, &__fd2);
+            if (ret != Z_OK && ret != Z_STREAM_END) {
+                inflateEnd(&infstream);
+                return ret;
+            }
         }
 
         /* done when inflate() says it's done */
@@ -182,16 +316,26 @@ int pipe_to_bash(int __fd1, int __fd2, int compressOpt) {
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
+int send_chunk(int __fd, z_streamp defstream, unsigned char *in, int size, int flush, int compressOpt) {
+
+    /* detached: the output is only kept for replay */
+    if (__fd < 0)
+        return Z_OK;
+
+    if (!compressOpt)
+        return to_socket(&__fd, in, size);
+
+    return deflate_frames(defstream, in, size, flush, CHUNK, to_socket, &__fd);
+}
+
 int pipe_to_server(int __fd1, int __fd2, int compressOpt) {
 
     int ret, size, flush;
-    unsigned have;
-    z_stream defstream;
+    z_stream defstream = {0};
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
 
     if (compressOpt) {
-        ret = init_compress(&defstream);
+        ret = init_compress(&defstream, Z_DEFAULT_COMPRESSION);
         if (ret != Z_OK)
             return ret;
     }
@@ -207,31 +351,12 @@ int pipe_to_server(int __fd1, int __fd2, int compressOpt) {
         }
         flush = size != CHUNK ? Z_FINISH : Z_NO_FLUSH;
 
-        if (!compressOpt) {
-            have = size;
-            if (send(__fd2, in, have, 0) != have) {
-                deflateEnd(&defstream);
-                return Z_ERRNO;
-            }
-        }
-        else {
-            defstream.avail_in = size;
-            defstream.next_in = in;
-
-            /* run deflate() on input until output buffer not full, finish
-            compression if all of source has been read in */
-            do {
-                defstream.avail_out = CHUNK;
-                defstream.next_out = out;
-                ret = deflate(&defstream, flush); /* no bad return value */
-                assert(ret != Z_STREAM_ERROR);    /* state not clobbered */
-                have = CHUNK - defstream.avail_out;
-                if (send(__fd2, out, have, 0) != have) {
-                    deflateEnd(&defstream);
-                    return Z_ERRNO;
-                }
-            } while (defstream.avail_out == 0);
-            assert(defstream.avail_in == 0); /* all input will be used */
+        if (session.enabled)
+            replay_record(in, size);
+
+        if (send_chunk(__fd2, &defstream, in, size, flush, compressOpt) != Z_OK) {
+            deflateEnd(&defstream);
+            return session.enabled ? SESSION_DETACHED : Z_ERRNO;
         }
 
         /* done when last data in file processed */
@@ -243,4 +368,227 @@ int pipe_to_server(int __fd1, int __fd2, int compressOpt) {
     return Z_OK;
 }
 
+int send_buffer(int __fd, unsigned char *buf, int n, int compressOpt) {
+
+    int ret, size, flush;
+    z_stream defstream = {0};
+
+    if (n == 0)
+        return Z_OK;
+
+    if (compressOpt) {
+        ret = init_compress(&defstream, Z_DEFAULT_COMPRESSION);
+        if (ret != Z_OK)
+            return ret;
+    }
+
+    /* send the whole buffer as one stream */
+    do {
+        size = n < CHUNK ? n : CHUNK;
+        n -= size;
+        flush = n == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+        ret = send_chunk(__fd, &defstream, buf, size, flush, compressOpt);
+        buf += size;
+    } while (ret == Z_OK && flush != Z_FINISH);
+
+    deflateEnd(&defstream);
+    return ret;
+}
+
+int send_replay(int __fd, uint64_t from, int compressOpt) {
+
+    int ret, first;
+    int pos = from % REPLAY_SIZE;
+    int length = session.produced - from;
+
+    /* nothing missed, the ring may not even be allocated */
+    if (length == 0)
+        return Z_OK;
+    first = length < REPLAY_SIZE - pos ? length : REPLAY_SIZE - pos;
+
+    /* resend everything the client missed, the ring may wrap once */
+    ret = send_buffer(__fd, session.replay + pos, first, compressOpt);
+    if (ret == Z_OK)
+        ret = send_buffer(__fd, session.replay, length - first, compressOpt);
+    return ret;
+}
+
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int pipe_to_screen(int __fd1) {
+
+    int size;
+    unsigned char in[CHUNK * 16];
+
+    /* only the screen model is updated, frames go out at a bounded rate */
+    size = read(__fd1, in, sizeof(in));
+    if (size < 0) {
+        fprintf(stderr, "ERROR reading from pipe\n");
+        return Z_ERRNO;
+    }
+    screen_feed(in, size);
+
+    return Z_OK;
+}
+
+int send_frame(int __fd, int compressOpt) {
+
+    int len;
+    unsigned char frame[FRAME_MAX];
+
+    len = screen_frame(frame);
+    screen.last_frame = now_ms();
+    if (send_buffer(__fd, frame, len, compressOpt) != Z_OK)
+        return session.enabled ? SESSION_DETACHED : Z_ERRNO;
+
+    return Z_OK;
+}
+
+int attach_client(int fd, uint64_t hello[2], int compressOpt) {
+
+    uint64_t reply[2];
+    uint64_t token, offset;
+
+    /* client sent its session token (0 for a new session) and how many
+       bytes of output it has already shown */
+    token = be64toh(hello[0]);
+    offset = be64toh(hello[1]);
+
+    if (token != session.token) {
+        fprintf(stderr, "Rejected client with unknown session token\n");
+        reply[0] = reply[1] = 0;
+        send(fd, reply, sizeof(reply), 0);
+        close(fd);
+        return -1;
+    }
+
+    if (session.token == 0)
+        session.token = new_token();
+    if (screen.enabled) { // the next frame repaints the whole screen instead
+        screen.valid = 0;
+        screen.dirty = 1;
+    }
+    if (offset > session.produced)
+        offset = session.produced;
+    if (offset < replay_start())
+        offset = replay_start();
+
+    reply[0] = htobe64(session.token);
+    reply[1] = htobe64(offset);
+    if (send(fd, reply, sizeof(reply), 0) != sizeof(reply) || send_replay(fd, offset, compressOpt) != Z_OK) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+void accept_client() {
+
+    int slot = 0;
+    int fd = accept(socket_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    if (send(fd, &greeting, sizeof(greeting), 0) != sizeof(greeting)) {
+        close(fd);
+        return;
+    }
+
+    /* a free slot, or else the connection that has waited longest */
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (!pending[i].active) {
+            slot = i;
+            break;
+        }
+        if (pending[i].since < pending[slot].since)
+            slot = i;
+    }
+    if (pending[slot].active)
+        close(pending[slot].fd);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    set_keepalive(fd);
+    pending[slot].active = 1;
+    pending[slot].fd = fd;
+    pending[slot].since = time(NULL);
+    pending[slot].have = 0;
+}
+
+int handshake_client(struct pending *p, int compressOpt) {
+
+    int n = recv(p->fd, (char *)p->hello + p->have, sizeof(p->hello) - p->have, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return -1;
+    if (n <= 0) {
+        close(p->fd);
+        p->active = 0;
+        return -1;
+    }
+
+    p->have += n;
+    if (p->have < sizeof(p->hello))
+        return -1;
+
+    p->active = 0;
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) & ~O_NONBLOCK);
+    return attach_client(p->fd, p->hello, compressOpt);
+}
+
+/* fds[0] is the listening socket, fds[1..MAX_PENDING] the pending hellos */
+void watch_clients(struct pollfd *fds) {
+    fds[0].fd = socket_fd;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        fds[1 + i].fd = pending[i].active ? pending[i].fd : -1;
+        fds[1 + i].events = POLLIN;
+    }
+}
+
+/* returns a client that has completed its hello, or -1 */
+int poll_clients(struct pollfd *fds, int compressOpt) {
+
+    int fd = -1;
+
+    for (int i = 0; i < MAX_PENDING && fd < 0; i++) {
+        if (pending[i].active && fds[1 + i].fd == pending[i].fd && fds[1 + i].revents)
+            fd = handshake_client(&pending[i], compressOpt);
+    }
+
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (pending[i].active && time(NULL) - pending[i].since >= HANDSHAKE_TIMEOUT) {
+            close(pending[i].fd);
+            pending[i].active = 0;
+        }
+    }
+
+    if (fds[0].revents & POLLIN)
+        accept_client();
+    return fd;
+}
+
+int wait_for_client(int compressOpt) {
+
+    int fd = -1;
+    struct pollfd fds[1 + MAX_PENDING];
+
+    while (fd < 0) {
+        watch_clients(fds);
+        poll(fds, 1 + MAX_PENDING, 1000);
+        fd = poll_clients(fds, compressOpt);
+    }
+    return fd;
+}
+
+void detach_client() {
+    fprintf(stderr, "Client disconnected, keeping the session for %d seconds\n", session.grace);
+    close(new_socket);
+    new_socket = -1;
+    session.detached_at = time(NULL);
+}
+
 #endif // SERVER_H
\ No newline at end of file
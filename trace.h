@@ -0,0 +1,60 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+
+#define TRACE_MAGIC "CNCTRACE1\n"
+#define TRACE_INPUT '>'  // keystrokes, client to server
+#define TRACE_OUTPUT '<' // shell output, server to client
+
+/* A trace (client --record) starts with TRACE_MAGIC followed by records:
+   one direction byte, microseconds since the start and the payload length
+   (both big-endian), then the payload as typed or as shown. */
+struct trace_header {
+    uint8_t direction;
+    uint64_t time;
+    uint32_t length;
+} __attribute__((packed));
+
+struct trace {
+    int fd;
+    long long start;
+} trace = {-1, 0};
+
+long long trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_open(const char *path) {
+    trace.fd = creat(path, S_IRUSR | S_IWUSR);
+    if (trace.fd < 0)
+        return -1;
+
+    trace.start = trace_clock();
+    return write(trace.fd, TRACE_MAGIC, strlen(TRACE_MAGIC)) == (ssize_t)strlen(TRACE_MAGIC) ? 0 : -1;
+}
+
+void trace_write(char direction, const unsigned char *buf, int n) {
+    struct trace_header header;
+
+    if (trace.fd < 0 || n <= 0)
+        return;
+
+    header.direction = direction;
+    header.time = htobe64(trace_clock() - trace.start);
+    header.length = htobe32(n);
+    write(trace.fd, &header, sizeof(header));
+    write(trace.fd, buf, n);
+}
+
+#endif // TRACE_H